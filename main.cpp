@@ -1,15 +1,9 @@
 ﻿#include <filesystem>
 #include <iostream>
-#include <vector>
-#include <numeric>
-#include <thread>
 #include <exception>
-#include <mz.h>
-#include <mz_os.h>
-#include <mz_strm.h>
-#include <mz_strm_os.h>
-#include <mz_zip.h>
-#include <mz_zip_rw.h>
+#include <cctype>
+#include <limits>
+#include <stdexcept>
 #include <tclap/CmdLine.h>
 #include <indicators/progress_bar.hpp>
 #include <config.h>
@@ -21,46 +15,34 @@ using std::cerr;
 using std::endl;
 using std::flush;
 
-void  zip_directory(const fs::path& input, const fs::path& output, int16_t level) {
-  void* zip_writer;
-  void* file_stream;
-  int32_t err;
-  mz_zip_writer_create(&zip_writer);
-  mz_stream_os_create(&file_stream);
-  mz_zip_writer_set_compress_method(zip_writer, MZ_COMPRESS_METHOD_DEFLATE);
-  mz_zip_writer_set_compress_level(zip_writer, level);
-  err = stream_os_open(file_stream, output, MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to open a zip file:" + output.string());
+// e.g. "500M", "2G". Plain numbers are bytes.
+uint64_t parse_size(const std::string& str) {
+  const auto invalid = std::runtime_error("Invalid size: \"" + str + "\". Use a positive number with an optional K/M/G/T suffix.");
+  if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0]))) {
+    throw invalid;
   }
-  err = mz_zip_writer_open(zip_writer, file_stream, 0);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to open a zip file:" + output.string());
+  size_t pos = 0;
+  uint64_t size = 0;
+  try {
+    size = std::stoull(str, &pos);
   }
-
-#ifdef _WIN32
-  auto utf8 = wstr2utf8(input.wstring());
-  err = mz_zip_writer_add_path(zip_writer, utf8.c_str(), NULL, 0, 1);
-#else
-  err = mz_zip_writer_add_path(zip_writer, input.string().c_str(), NULL, 0, 1);
-#endif
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to compress:" + input.string());
+  catch (const std::out_of_range&) {
+    throw invalid;
   }
-
-  err = mz_zip_writer_close(zip_writer);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to close the zip writer:" + output.string());
+  auto unit = str.substr(pos);
+  const std::string units = "KMGT";
+  if (unit.empty() || unit == "B") {
+    return size;
   }
-  mz_stream_os_close(file_stream);
-  mz_stream_os_delete(&file_stream);
-  mz_zip_writer_delete(&zip_writer);
-};
-
-fs::path input2output(const fs::path& input_dir, const fs::path& output_dir, const fs::path& input) {
-  auto relative = input.lexically_relative(input_dir);
-  auto output = (output_dir / relative).WSTRING() + WPREFIX(".zip");
-  return output;
+  auto u = units.find(static_cast<char>(std::toupper(static_cast<unsigned char>(unit[0]))));
+  if (u == std::string::npos || unit.size() > 2 || (unit.size() == 2 && std::toupper(static_cast<unsigned char>(unit[1])) != 'B')) {
+    throw invalid;
+  }
+  auto shift = 10 * (u + 1);
+  if (size > (std::numeric_limits<uint64_t>::max() >> shift)) {
+    throw invalid;
+  }
+  return size << shift;
 }
 
 int main(int argc, char* argv[])
@@ -73,6 +55,10 @@ int main(int argc, char* argv[])
     TCLAP::ValueArg<int> a_depth("d", "depth", "(optional) Depth of the subdirectories.", false, 0, "int", cmd);
     TCLAP::ValueArg<int> a_jobs("j", "jobs", "(optional) Number of simultaneous jobs.", false, 0, "int", cmd);
     TCLAP::ValueArg<int> a_level("l", "level", "(optional) Compression level. Default value is 1.", false, 1, "int", cmd);
+    std::vector<std::string> methods{ "deflate", "store" };
+    TCLAP::ValuesConstraint<std::string> method_constraint(methods);
+    TCLAP::ValueArg<std::string> a_method("m", "method", "(optional) Compression method. Default value is deflate.", false, "deflate", &method_constraint, cmd);
+    TCLAP::ValueArg<std::string> a_max_size("", "max-archive-size", "(optional) Split a directory into <name>.partNNN.zip files of about this input size (e.g. 500M, 4G).", false, "", "size", cmd);
 
     TCLAP::SwitchArg a_file("", "file", "Compress files too, not just directories.", cmd);
     TCLAP::SwitchArg a_skip_empty("", "skip_empty", "Skip zipping empty directories.", cmd);
@@ -83,37 +69,42 @@ int main(int argc, char* argv[])
 
     auto input_dir = fs::path(a_input.getValue());
     auto output_dir = fs::path(a_output.isSet() ? a_output.getValue() : a_input.getValue());
-    auto depth = a_depth.getValue();
-    auto jobs = a_jobs.getValue();
-    auto level = a_level.getValue();
-    auto subdirs = list_subdirs(input_dir, depth, a_all.isSet(), a_file.isSet());
+    ZipOptions options;
+    options.depth = a_depth.getValue();
+    options.all = a_all.isSet();
+    options.include_files = a_file.isSet();
+    options.skip_empty = a_skip_empty.isSet();
+    options.skip_existing = a_skip_exists.isSet();
+    options.level = a_level.getValue();
+    options.method = a_method.getValue() == "store" ? CompressMethod::Store : CompressMethod::Deflate;
+    if (a_max_size.isSet()) {
+      options.max_archive_size = parse_size(a_max_size.getValue());
+      if (options.max_archive_size == 0) {
+        throw std::runtime_error("--max-archive-size must be positive.");
+      }
+    }
+    options.jobs = a_jobs.getValue();
+    ThreadPool pool(options.jobs);
+    if (options.jobs <= 0) {
+      cout << "Using " << pool.size() << " CPU cores." << endl;
+    }
 
-    if (a_skip_exists.isSet()) {
-      auto result = std::remove_if(subdirs.begin(), subdirs.end(), [&input_dir, &output_dir](auto& d) {
-        auto output = input2output(input_dir, output_dir, d);
-        return fs::exists(output);
-        });
-      auto orig_size = subdirs.size();
-      subdirs.erase(result, subdirs.end());
-      cout << "Skip " << orig_size - subdirs.size() << " existing entries." << endl;
+    ListSummary summary;
+    auto zip_jobs = list_zip_jobs(pool, input_dir, output_dir, options, &summary);
+    if (options.skip_existing) {
+      cout << "Skip " << summary.skipped_existing << " existing entries." << endl;
     }
-    if (a_skip_empty.isSet()) {
-      auto orig_size = subdirs.size();
-      auto result = std::remove_if(subdirs.begin(), subdirs.end(), [](auto& d) {
-        return fs::is_directory(d) && fs::is_empty(d);
-        });
-      subdirs.erase(result, subdirs.end());
-      cout << "Skip " << orig_size - subdirs.size() << " empty directories." << endl;
+    if (options.skip_empty) {
+      cout << "Skip " << summary.skipped_empty << " empty directories." << endl;
     }
-    if (subdirs.empty()) {
+    if (zip_jobs.empty()) {
       cout << "There is nothing to compress." << endl;
       return 0;
     }
     if (a_dryrun.isSet()) {
       auto mode = local_setmode();
-      for (const auto& d : subdirs) {
-        auto output = input2output(input_dir, output_dir, d);
-        WCOUT << d.WSTRING() << " -> " << output.WSTRING() << '\n';
+      for (const auto& job : zip_jobs) {
+        WCOUT << job.input.WSTRING() << " -> " << job.output.WSTRING() << '\n';
       }
       cout << flush;
       return 0;
@@ -121,7 +112,7 @@ int main(int argc, char* argv[])
     using namespace indicators;
     ProgressBar bar{
        option::BarWidth{30},
-       option::MaxProgress(subdirs.size()),
+       option::MaxProgress(zip_jobs.size()),
        option::Start{"["},
        option::Fill{"="},
        option::Lead{">"},
@@ -131,42 +122,13 @@ int main(int argc, char* argv[])
        option::ShowElapsedTime{true},
        option::ShowRemainingTime{true},
     };
-    if (jobs <= 0) {
-      jobs = get_physical_core_counts();
-      cout << "Using " << jobs << " CPU cores." << endl;
-    }
-    std::exception_ptr ep;
-    std::mutex mtx_mkdir;
-    std::vector<std::thread> threads;
-    threads.reserve(jobs);
-    for (int job_id = 0; job_id < jobs; ++job_id) {
-      threads.emplace_back([job_id, jobs, level, &subdirs, &input_dir, &output_dir, &bar, &mtx_mkdir, &ep]() {
-        for (int i = job_id; i < subdirs.size(); i += jobs) {
-          const auto& subdir = subdirs[i];
-          auto output = input2output(input_dir, output_dir, subdir);
-          {
-            std::lock_guard<std::mutex> lock(mtx_mkdir);
-            if (!fs::exists(output.parent_path())) {
-              fs::create_directories(output.parent_path());
-            }
-          }
-          try {
-            zip_directory(subdir, output, level);
-          }
-          catch (...) {
-            ep = std::current_exception();
-            break;
-          }
-          bar.tick();
-        }
-        });
-    }
-    for (auto& t : threads) {
-      t.join();
-    }
-    if (ep) {
-      std::rethrow_exception(ep);
-    }
+    BatchCallbacks callbacks;
+    callbacks.on_item = [&bar](const ArchiveJob&, std::exception_ptr error) {
+      if (!error) {
+        bar.tick();
+      }
+    };
+    zip_batch(pool, zip_jobs, options, callbacks);
   }
   catch (TCLAP::ArgException& e)
   {
@@ -0,0 +1,99 @@
+#include <filesystem>
+#include <iostream>
+#include <exception>
+#include <tclap/CmdLine.h>
+#include <indicators/progress_bar.hpp>
+#include <config.h>
+#include "szkarc.h"
+
+namespace fs = std::filesystem;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::flush;
+
+int main(int argc, char* argv[])
+{
+  try {
+    TCLAP::CmdLine cmd("Recompress all zip files in the input directory. version: " PROJECT_VERSION, ' ', PROJECT_VERSION);
+
+    TCLAP::UnlabeledValueArg<std::string> a_input("input", "Input directory", true, "", "input", cmd);
+    TCLAP::UnlabeledValueArg<std::string> a_output("output", "(optional) Output directory. <input> is used as <output> by default.", false, "", "output", cmd);
+    TCLAP::ValueArg<int> a_depth("d", "depth", "(optional) Depth of the subdirectories.", false, 0, "int", cmd);
+    TCLAP::ValueArg<int> a_jobs("j", "jobs", "(optional) Number of simultaneous jobs.", false, 0, "int", cmd);
+    TCLAP::ValueArg<int> a_level("l", "level", "(optional) Compression level. Default value is 1.", false, 1, "int", cmd);
+    std::vector<std::string> methods{ "deflate", "store" };
+    TCLAP::ValuesConstraint<std::string> method_constraint(methods);
+    TCLAP::ValueArg<std::string> a_method("m", "method", "(optional) Compression method. Default value is deflate.", false, "deflate", &method_constraint, cmd);
+
+    TCLAP::SwitchArg a_force("f", "force", "Recompress entries even when their method and level look unchanged.", cmd);
+    TCLAP::SwitchArg a_skip_exists("", "skip_existing", "Dont't recompress when the output file exists.", cmd);
+    TCLAP::SwitchArg a_dryrun("", "dryrun", "List zip files to recompress and exit.", cmd);
+    cmd.parse(argc, argv);
+
+    auto input_dir = fs::path(a_input.getValue());
+    auto output_dir = fs::path(a_output.isSet() ? a_output.getValue() : a_input.getValue());
+    RezipOptions options;
+    options.depth = a_depth.getValue();
+    options.skip_existing = a_skip_exists.isSet();
+    options.force = a_force.isSet();
+    options.level = a_level.getValue();
+    options.method = a_method.getValue() == "store" ? CompressMethod::Store : CompressMethod::Deflate;
+    options.jobs = a_jobs.getValue();
+    ListSummary summary;
+    auto rezip_jobs = list_rezip_jobs(input_dir, output_dir, options, &summary);
+    if (options.skip_existing) {
+      cout << "Skip " << summary.skipped_existing << " existing entries." << endl;
+    }
+    if (rezip_jobs.empty()) {
+      cout << "There is nothing to recompress." << endl;
+      return 0;
+    }
+    if (a_dryrun.isSet()) {
+      auto mode = local_setmode();
+      for (const auto& job : rezip_jobs) {
+        WCOUT << job.input.WSTRING() << " -> " << job.output.WSTRING() << '\n';
+      }
+      cout << flush;
+      return 0;
+    }
+    using namespace indicators;
+    ProgressBar bar{
+       option::BarWidth{30},
+       option::MaxProgress(rezip_jobs.size()),
+       option::Start{"["},
+       option::Fill{"="},
+       option::Lead{">"},
+       option::Remainder{" "},
+       option::End{"]"},
+       option::PrefixText{"Recompressing"},
+       option::ShowElapsedTime{true},
+       option::ShowRemainingTime{true},
+    };
+    ThreadPool pool(options.jobs);
+    if (options.jobs <= 0) {
+      cout << "Using " << pool.size() << " CPU cores." << endl;
+    }
+    BatchCallbacks callbacks;
+    callbacks.on_item = [&bar](const ArchiveJob&, std::exception_ptr error) {
+      if (!error) {
+        bar.tick();
+      }
+    };
+    rezip_batch(pool, rezip_jobs, options, callbacks);
+  }
+  catch (TCLAP::ArgException& e)
+  {
+    std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+    return 1;
+  }
+  catch (std::exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  catch (const std::string& e) {
+    cerr << e << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,11 +1,19 @@
 #include "szkarc.h"
 #include <thread>
 #include <iostream>
+#include <mutex>
+#include <exception>
 #include <codecvt>
+#include <cstdio>
+#include <chrono>
+#include <queue>
+#include <unordered_map>
 #include <mz.h>
 #include <mz_os.h>
 #include <mz_strm.h>
 #include <mz_strm_os.h>
+#include <mz_zip.h>
+#include <mz_zip_rw.h>
 namespace fs = std::filesystem;
 
 #ifdef _WIN32
@@ -173,5 +181,882 @@ PathList list_subdirs(const std::filesystem::path& indir, int depth, bool all, b
   }
 }
 
+std::string path2utf8(const std::filesystem::path& path) {
+#ifdef _WIN32
+  return wstr2utf8(path.wstring());
+#else
+  return path.string();
+#endif
+}
+
+std::filesystem::path split_part_path(const std::filesystem::path& zip_path, size_t part) {
+  char suffix[32];
+  std::snprintf(suffix, sizeof(suffix), ".part%03zu", part);
+  auto stem = zip_path;
+  stem.replace_extension("");
+  stem += suffix;
+  stem += zip_path.extension();
+  return stem;
+}
+
+std::filesystem::path remove_part_extension(const std::filesystem::path& path) {
+  auto ext = path.extension().string();
+  if (ext.size() >= 8 && ext.compare(0, 5, ".part") == 0
+    && std::all_of(ext.cbegin() + 5, ext.cend(), [](char c) {return '0' <= c && c <= '9'; })) {
+    return fs::path(path).replace_extension("");
+  }
+  return path;
+}
+
+bool is_split_part(const std::filesystem::path& zip_path) {
+  auto stem = fs::path(zip_path).replace_extension("");
+  auto base = remove_part_extension(stem);
+  if (base == stem) {
+    return false;
+  }
+  base += zip_path.extension();
+  return fs::exists(split_part_path(base, 1));
+}
 
+bool DirCache::contains(const Key& key) {
+  std::shared_lock<std::shared_mutex> lock(mtx);
+  return created.find(key) != created.end();
+}
+
+void DirCache::create(const std::filesystem::path& dir) {
+  auto normal = dir.lexically_normal();
+  if (!normal.has_filename()) { // trailing separator
+    normal = normal.parent_path();
+  }
+  if (normal.empty() || contains(normal.native())) {
+    return;
+  }
+  auto parent = normal.parent_path();
+  if (parent != normal) {
+    create(parent);
+  }
+  // create_directory() returns false for an existing directory, so a race with another thread is harmless.
+  if (!fs::create_directory(normal) && !fs::is_directory(normal)) {
+    throw std::runtime_error("Failed to create a directory:" + normal.string());
+  }
+  std::unique_lock<std::shared_mutex> lock(mtx);
+  created.insert(normal.native());
+}
+
+void DirCache::create_all(const PathList& dirs, ThreadPool& pool) {
+  PathList unique_dirs;
+  unique_dirs.reserve(dirs.size());
+  std::transform(dirs.cbegin(), dirs.cend(), std::back_inserter(unique_dirs), [](const fs::path& d) {
+    return d.lexically_normal();
+    });
+  std::sort(unique_dirs.begin(), unique_dirs.end());
+  unique_dirs.erase(std::unique(unique_dirs.begin(), unique_dirs.end()), unique_dirs.end());
+  pool.parallel_for(unique_dirs.size(), [this, &unique_dirs](size_t i) {
+    create(unique_dirs[i]);
+    });
+}
+
+ThreadPool::ThreadPool(int jobs) {
+  if (jobs <= 0) {
+    jobs = std::max(1, get_physical_core_counts());
+  }
+  workers.reserve(jobs);
+  for (int i = 0; i < jobs; ++i) {
+    workers.emplace_back([this]() { work(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stop = true;
+  }
+  cv_start.notify_all();
+  for (auto& t : workers) {
+    t.join();
+  }
+}
+
+void ThreadPool::work() {
+  size_t seen = 0;
+  while (true) {
+    const std::function<void(size_t)>* fn;
+    size_t n;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv_start.wait(lock, [this, seen]() { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+      fn = task;
+      n = task_size;
+    }
+    for (size_t i = next++; i < n; i = next++) {
+      try {
+        (*fn)(i);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!ep) {
+          ep = std::current_exception();
+        }
+        next = n;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    if (--running == 0) {
+      cv_done.notify_all();
+    }
+  }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& fn) {
+  if (n == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> batch(mtx_batch);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    task = &fn;
+    task_size = n;
+    next = 0;
+    ep = nullptr;
+    running = workers.size();
+    ++generation;
+  }
+  cv_start.notify_all();
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_done.wait(lock, [this]() { return running == 0; });
+    task = nullptr;
+    std::swap(error, ep);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+fs::path zip_output_path(const fs::path& input_dir, const fs::path& output_dir, const fs::path& input) {
+  auto relative = input.lexically_relative(input_dir);
+  auto output = (output_dir / relative).WSTRING() + WPREFIX(".zip");
+  return output;
+}
+
+fs::path unzip_output_path(const fs::path& input_dir, const fs::path& output_dir, const fs::path& input) {
+  auto relative = input.lexically_relative(input_dir).replace_extension("");
+  // all parts of a split archive are extracted into the same directory.
+  if (is_split_part(input)) {
+    relative = remove_part_extension(relative);
+  }
+  return (output_dir / relative).WSTRING();
+}
+
+fs::path rezip_output_path(const fs::path& input_dir, const fs::path& output_dir, const fs::path& input) {
+  auto relative = input.lexically_relative(input_dir);
+  return (output_dir / relative).WSTRING();
+}
+
+PathList list_zipfiles(const fs::path& indir, int depth) {
+  PathList list;
+  if (depth > 0) {
+    for (const auto& ent : fs::directory_iterator(indir)) {
+      if (ent.is_directory()) {
+        list.emplace_back(ent.path());
+      }
+    }
+    std::sort(list.begin(), list.end());
+    std::vector<PathList> nested;
+    std::transform(list.cbegin(), list.cend(), std::back_inserter(nested), [depth](const fs::path& p) {
+      return list_zipfiles(p, depth - 1);
+      });
+    auto flat = flatten_nested(nested);
+    return flat;
+  }
+  else {
+    for (const auto& ent : fs::directory_iterator(indir)) {
+      if (ent.path().extension()==".zip") {
+        list.emplace_back(ent.path());
+      }
+    }
+    std::sort(list.begin(), list.end());
+    return list;
+  }
+}
+
+namespace {
+
+// Thrown inside a job to abort it on cancellation.
+struct Cancelled {};
+
+// Closes and deletes minizip handles on scope exit. A zip handle is deleted before its stream.
+struct ZipHandles {
+  void* reader = nullptr;
+  void* writer = nullptr;
+  void* in_stream = nullptr;
+  void* out_stream = nullptr;
+  ZipHandles() = default;
+  ZipHandles(const ZipHandles&) = delete;
+  ZipHandles& operator=(const ZipHandles&) = delete;
+  ~ZipHandles() {
+    if (writer) {
+      mz_zip_writer_delete(&writer);
+    }
+    if (reader) {
+      mz_zip_reader_delete(&reader);
+    }
+    for (void** stream : { &out_stream, &in_stream }) {
+      if (*stream) {
+        mz_stream_os_close(*stream);
+        mz_stream_os_delete(stream);
+      }
+    }
+  }
+};
+
+// "<path>.tmp" which is removed on scope exit unless commit() renamed it to <path>.
+class TempFile {
+private:
+  fs::path target;
+  fs::path tmp;
+  bool committed = false;
+public:
+  explicit TempFile(const fs::path& path) : target(path), tmp(path) {
+    tmp += ".tmp";
+  }
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+  ~TempFile() {
+    if (!committed) {
+      std::error_code ec;
+      fs::remove(tmp, ec);
+    }
+  }
+  const fs::path& path() const { return tmp; }
+  void commit() {
+    fs::rename(tmp, target);
+    committed = true;
+  }
+};
+
+// Directories and files under `input`, sorted so that a directory comes before its contents.
+// Symbolic links are followed, as mz_zip_writer_add_path() does by default.
+ArchiveJob list_entries(const fs::path& input, const fs::path& output) {
+  ArchiveJob job{ input, output, PathList{}, 0 };
+  if (!fs::is_directory(input)) {
+    job.entries->push_back(input);
+    job.bytes = fs::file_size(input);
+    return job;
+  }
+  for (const auto& ent : fs::recursive_directory_iterator(input, fs::directory_options::follow_directory_symlink)) {
+    if (!ent.is_directory()) {
+      job.bytes += ent.file_size();
+    }
+    job.entries->push_back(ent.path());
+  }
+  std::sort(job.entries->begin(), job.entries->end());
+  return job;
+}
+
+// Split files under `input` into parts of roughly `max_size` bytes each, balanced by input bytes.
+// Directory entries go to the first part so that empty directories are preserved.
+std::vector<ArchiveJob> split_directory(const fs::path& input, const fs::path& output, uint64_t max_size) {
+  PathList dirs;
+  std::vector<std::pair<uint64_t, fs::path>> files;
+  uint64_t total = 0;
+  for (const auto& ent : fs::recursive_directory_iterator(input, fs::directory_options::follow_directory_symlink)) {
+    if (ent.is_directory()) {
+      dirs.push_back(ent.path());
+    }
+    else {
+      auto size = ent.file_size();
+      files.emplace_back(size, ent.path());
+      total += size;
+    }
+  }
+  // every part needs at least one non-empty file; empty files do not raise a part's load.
+  auto n_nonempty = static_cast<size_t>(std::count_if(files.cbegin(), files.cend(), [](const auto& f) { return f.first > 0; }));
+  size_t n_parts = std::min(static_cast<size_t>((total + max_size - 1) / max_size), n_nonempty);
+  if (n_parts <= 1) {
+    return { ArchiveJob{input, output, {}, total} };
+  }
+
+  // Largest first, each file to the currently smallest part.
+  std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+  using Load = std::pair<uint64_t, size_t>;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+  for (size_t i = 0; i < n_parts; ++i) {
+    loads.emplace(0, i);
+  }
+  std::vector<ArchiveJob> parts(n_parts, ArchiveJob{ input, {}, PathList{}, 0 });
+  for (auto& f : files) {
+    auto [load, i] = loads.top();
+    loads.pop();
+    parts[i].entries->push_back(std::move(f.second));
+    parts[i].bytes += f.first;
+    loads.emplace(load + f.first, i);
+  }
+  parts[0].entries->insert(parts[0].entries->end(), dirs.begin(), dirs.end());
+  for (size_t i = 0; i < n_parts; ++i) {
+    parts[i].output = split_part_path(output, i + 1);
+    std::sort(parts[i].entries->begin(), parts[i].entries->end());
+  }
+  return parts;
+}
+
+uint16_t mz_compress_method(CompressMethod method) {
+  switch (method) {
+  case CompressMethod::Store:
+    return MZ_COMPRESS_METHOD_STORE;
+  case CompressMethod::Deflate:
+  default:
+    return MZ_COMPRESS_METHOD_DEFLATE;
+  }
+}
+
+// Returns the number of input bytes.
+uint64_t zip_directory(const ArchiveJob& job, const ZipOptions& options, const CancellationToken& cancel) {
+  // entries are named relative to the directory, or to the parent for a single file.
+  ArchiveJob listed;
+  const ArchiveJob* target = &job;
+  if (!job.entries) {
+    listed = list_entries(job.input, job.output);
+    target = &listed;
+  }
+  auto base = fs::is_directory(job.input) ? job.input : job.input.parent_path();
+  // declared before the handles so that the file is closed when it gets removed.
+  TempFile tmp_output(job.output);
+  ZipHandles zip;
+  mz_zip_writer_create(&zip.writer);
+  mz_stream_os_create(&zip.out_stream);
+  mz_zip_writer_set_compress_method(zip.writer, mz_compress_method(options.method));
+  mz_zip_writer_set_compress_level(zip.writer, options.level);
+  int32_t err = stream_os_open(zip.out_stream, tmp_output.path(), MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE);
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to open a zip file:" + tmp_output.path().string());
+  }
+  err = mz_zip_writer_open(zip.writer, zip.out_stream, 0);
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to open a zip file:" + tmp_output.path().string());
+  }
+
+  for (const auto& entry : *target->entries) {
+    if (cancel.cancelled()) {
+      throw Cancelled();
+    }
+    auto utf8 = path2utf8(entry);
+    auto filename_in_zip = entry.lexically_relative(base).generic_u8string();
+    err = mz_zip_writer_add_file(zip.writer, utf8.c_str(), filename_in_zip.c_str());
+    if (err != MZ_OK) {
+      throw std::runtime_error("Failed to compress:" + entry.string());
+    }
+  }
+
+  err = mz_zip_writer_close(zip.writer);
+  if (err == MZ_OK) {
+    err = mz_stream_os_close(zip.out_stream);
+  }
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to close the zip writer:" + tmp_output.path().string());
+  }
+  tmp_output.commit();
+  return target->bytes;
+}
+
+// Reject entry names which would be written outside of the output directory.
+fs::path entry2output(const fs::path& output, const char* filename) {
+  auto relative = fs::u8path(filename).lexically_normal();
+  if (relative.is_absolute() || relative.has_root_name() || (!relative.empty() && *relative.begin() == "..")) {
+    throw std::runtime_error("Invalid entry name:" + std::string(filename));
+  }
+  return output / relative;
+}
+
+void unzip_entry(void* zip_reader, const fs::path& entry_path, const mz_zip_file* file_info) {
+  void* entry_stream;
+  mz_stream_os_create(&entry_stream);
+  int32_t err = stream_os_open(entry_stream, entry_path, MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE);
+  if (err != MZ_OK) {
+    mz_stream_os_delete(&entry_stream);
+    throw std::runtime_error("Failed to open a file:" + entry_path.string());
+  }
+  err = mz_zip_reader_entry_save(zip_reader, entry_stream, mz_stream_os_write);
+  mz_stream_os_close(entry_stream);
+  mz_stream_os_delete(&entry_stream);
+  if (err != MZ_OK) {
+    std::error_code ec;
+    fs::remove(entry_path, ec);
+    throw std::runtime_error("Failed to extract:" + entry_path.string());
+  }
+
+  auto utf8 = path2utf8(entry_path);
+  mz_os_set_file_date(utf8.c_str(), file_info->modified_date, file_info->accessed_date, file_info->creation_date);
+  uint32_t target_attrib = 0;
+  if (mz_zip_attrib_convert(MZ_HOST_SYSTEM(file_info->version_madeby), file_info->external_fa,
+    MZ_HOST_SYSTEM(MZ_VERSION_MADEBY), &target_attrib) == MZ_OK) {
+    mz_os_set_file_attribs(utf8.c_str(), target_attrib);
+  }
+}
 
+void open_reader(ZipHandles& zip, const fs::path& input) {
+  mz_zip_reader_create(&zip.reader);
+  mz_stream_os_create(&zip.in_stream);
+  int32_t err = stream_os_open(zip.in_stream, input, MZ_OPEN_MODE_READ);
+  if (err == MZ_OK) {
+    err = mz_zip_reader_open(zip.reader, zip.in_stream);
+  }
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to open a zip file:" + input.string());
+  }
+}
+
+// The output directory and every directory the entries of `input` are written to.
+// Only the central directory is read.
+PathList list_entry_dirs(const fs::path& input, const fs::path& output) {
+  ZipHandles zip;
+  open_reader(zip, input);
+  std::unordered_set<fs::path::string_type> dirs{ output.native() };
+  int32_t err = mz_zip_reader_goto_first_entry(zip.reader);
+  while (err == MZ_OK) {
+    mz_zip_file* file_info = nullptr;
+    err = mz_zip_reader_entry_get_info(zip.reader, &file_info);
+    if (err != MZ_OK) {
+      break;
+    }
+    auto entry_path = entry2output(output, file_info->filename);
+    if (mz_zip_reader_entry_is_dir(zip.reader) == MZ_OK) {
+      dirs.insert((entry_path.has_filename() ? entry_path : entry_path.parent_path()).native());
+    }
+    else {
+      dirs.insert(entry_path.parent_path().native());
+    }
+    err = mz_zip_reader_goto_next_entry(zip.reader);
+  }
+  if (err != MZ_END_OF_LIST) {
+    throw std::runtime_error("Failed to read a zip file:" + input.string());
+  }
+  return PathList(dirs.cbegin(), dirs.cend());
+}
+
+// Entries are written one by one instead of mz_zip_reader_save_all().
+// Their directories are created beforehand by unzip_batch(), so no directory is stat-ed or created here.
+// Returns the number of uncompressed bytes.
+uint64_t unzip(const fs::path& input, const fs::path& output, const CancellationToken& cancel)
+{
+  ZipHandles zip;
+  open_reader(zip, input);
+  void* zip_reader = zip.reader;
+  void* zip_handle = nullptr;
+  mz_zip_reader_get_zip_handle(zip_reader, &zip_handle);
+
+  uint64_t bytes = 0;
+  int32_t err = mz_zip_reader_goto_first_entry(zip_reader);
+  while (err == MZ_OK) {
+    if (cancel.cancelled()) {
+      throw Cancelled();
+    }
+    mz_zip_file* file_info = nullptr;
+    err = mz_zip_reader_entry_get_info(zip_reader, &file_info);
+    if (err != MZ_OK) {
+      break;
+    }
+    auto entry_path = entry2output(output, file_info->filename);
+    if (mz_zip_entry_is_symlink(zip_handle) == MZ_OK) {
+      auto utf8 = path2utf8(entry_path);
+      err = mz_zip_reader_entry_save_file(zip_reader, utf8.c_str());
+    }
+    else if (mz_zip_reader_entry_is_dir(zip_reader) != MZ_OK) {
+      unzip_entry(zip_reader, entry_path, file_info);
+      bytes += file_info->uncompressed_size;
+    }
+    if (err != MZ_OK) {
+      break;
+    }
+    err = mz_zip_reader_goto_next_entry(zip_reader);
+  }
+  if (err != MZ_END_OF_LIST) {
+    throw std::runtime_error("Failed to decompress:" + input.string());
+  }
+
+  err = mz_zip_reader_close(zip_reader);
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to close a zip file:" + input.string());
+  }
+  return bytes;
+}
+
+// Deflate levels are recorded only coarsely in the general purpose flags. Mirrors mz_zip_entry_write_open().
+uint16_t deflate_level_flag(int16_t level) {
+  if (level == 8 || level == 9) {
+    return MZ_ZIP_FLAG_DEFLATE_MAX;
+  }
+  if (level == 2) {
+    return MZ_ZIP_FLAG_DEFLATE_FAST;
+  }
+  if (level == 1) {
+    return MZ_ZIP_FLAG_DEFLATE_SUPER_FAST;
+  }
+  return MZ_ZIP_FLAG_DEFLATE_NORMAL;
+}
+
+bool needs_recompress(const mz_zip_file* file_info, const RezipOptions& options) {
+  if ((file_info->flag & MZ_ZIP_FLAG_ENCRYPTED) || file_info->uncompressed_size == 0) {
+    return false;
+  }
+  // other methods (bzip2, lzma, zstd, ...) are not built in and cannot be decompressed.
+  if (file_info->compression_method != MZ_COMPRESS_METHOD_STORE
+    && file_info->compression_method != MZ_COMPRESS_METHOD_DEFLATE) {
+    return false;
+  }
+  if (options.force) {
+    return true;
+  }
+  auto method = mz_compress_method(options.method);
+  if (file_info->compression_method != method) {
+    return true;
+  }
+  const uint16_t level_mask = MZ_ZIP_FLAG_DEFLATE_MAX | MZ_ZIP_FLAG_DEFLATE_FAST;
+  return method == MZ_COMPRESS_METHOD_DEFLATE
+    && (file_info->flag & level_mask) != deflate_level_flag(options.level);
+}
+
+void recompress_entry(void* zip_reader, void* zip_writer, const mz_zip_file* file_info, uint16_t method, std::vector<uint8_t>& buf) {
+  mz_zip_file info = *file_info;
+  info.compression_method = method;
+  info.flag &= ~(MZ_ZIP_FLAG_DEFLATE_MAX | MZ_ZIP_FLAG_DEFLATE_FAST | MZ_ZIP_FLAG_DATA_DESCRIPTOR);
+  info.crc = 0;
+  info.compressed_size = 0;
+  int32_t err = mz_zip_reader_entry_open(zip_reader);
+  if (err == MZ_OK) {
+    err = mz_zip_writer_entry_open(zip_writer, &info);
+  }
+  while (err == MZ_OK) {
+    int32_t read = mz_zip_reader_entry_read(zip_reader, buf.data(), static_cast<int32_t>(buf.size()));
+    if (read <= 0) {
+      err = read;
+      break;
+    }
+    if (mz_zip_writer_entry_write(zip_writer, buf.data(), read) != read) {
+      err = MZ_WRITE_ERROR;
+    }
+  }
+  int32_t err_write = mz_zip_writer_entry_close(zip_writer);
+  // reports MZ_CRC_ERROR when the source data is corrupted.
+  int32_t err_read = mz_zip_reader_entry_close(zip_reader);
+  if (err_read != MZ_OK) {
+    throw std::runtime_error("Failed to read (corrupted?):" + std::string(file_info->filename));
+  }
+  if (err != MZ_OK || err_write != MZ_OK) {
+    throw std::runtime_error("Failed to recompress:" + std::string(file_info->filename));
+  }
+}
+
+// Returns the number of uncompressed bytes.
+uint64_t rezip(const fs::path& input, const fs::path& output, const RezipOptions& options, const CancellationToken& cancel) {
+  // declared before the handles so that the file is closed when it gets removed.
+  TempFile tmp_output(output);
+  ZipHandles zip;
+  mz_zip_reader_create(&zip.reader);
+  mz_zip_writer_create(&zip.writer);
+  mz_stream_os_create(&zip.in_stream);
+  mz_stream_os_create(&zip.out_stream);
+  mz_zip_writer_set_compress_method(zip.writer, mz_compress_method(options.method));
+  mz_zip_writer_set_compress_level(zip.writer, options.level);
+
+  int32_t err = stream_os_open(zip.in_stream, input, MZ_OPEN_MODE_READ);
+  if (err == MZ_OK) {
+    err = mz_zip_reader_open(zip.reader, zip.in_stream);
+  }
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to open a zip file:" + input.string());
+  }
+  err = stream_os_open(zip.out_stream, tmp_output.path(), MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE);
+  if (err == MZ_OK) {
+    err = mz_zip_writer_open(zip.writer, zip.out_stream, 0);
+  }
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to open a zip file:" + tmp_output.path().string());
+  }
+
+  std::vector<uint8_t> buf(UINT16_MAX);
+  uint64_t bytes = 0;
+  err = mz_zip_reader_goto_first_entry(zip.reader);
+  while (err == MZ_OK) {
+    if (cancel.cancelled()) {
+      throw Cancelled();
+    }
+    mz_zip_file* file_info = nullptr;
+    err = mz_zip_reader_entry_get_info(zip.reader, &file_info);
+    if (err != MZ_OK) {
+      break;
+    }
+    if (needs_recompress(file_info, options)) {
+      recompress_entry(zip.reader, zip.writer, file_info, mz_compress_method(options.method), buf);
+    }
+    else if (mz_zip_writer_copy_from_reader(zip.writer, zip.reader) != MZ_OK) {
+      throw std::runtime_error("Failed to copy:" + std::string(file_info->filename));
+    }
+    bytes += file_info->uncompressed_size;
+    err = mz_zip_reader_goto_next_entry(zip.reader);
+  }
+  if (err != MZ_END_OF_LIST) {
+    throw std::runtime_error("Failed to read a zip file:" + input.string());
+  }
+
+  err = mz_zip_writer_close(zip.writer);
+  if (err == MZ_OK) {
+    err = mz_stream_os_close(zip.out_stream);
+  }
+  if (err != MZ_OK) {
+    throw std::runtime_error("Failed to close the zip writer:" + tmp_output.path().string());
+  }
+  // the input must be closed before it is replaced in place.
+  mz_zip_reader_close(zip.reader);
+  mz_stream_os_close(zip.in_stream);
+  tmp_output.commit();
+  return bytes;
+}
+
+// "<name>.zip" and "<name>.partNNN.zip" -> "<name>"
+fs::path archive_base(const fs::path& zip_path) {
+  return remove_part_extension(fs::path(zip_path).replace_extension(""));
+}
+
+// Remove files of an earlier run which do not belong to the set just written to "<name>.zip":
+// the plain "<name>.zip" when `n_parts` > 0 parts were written, and "<name>.partNNN.zip" with NNN > n_parts.
+void remove_stale_outputs(const fs::path& plain_zip, size_t n_parts) {
+  if (n_parts > 0) {
+    fs::remove(plain_zip);
+  }
+  for (size_t part = n_parts + 1; fs::remove(split_part_path(plain_zip, part)); ++part) {
+  }
+}
+
+// `process(i)` runs jobs[i] and returns its number of bytes.
+Progress run_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs, const BatchCallbacks& callbacks,
+  const CancellationToken& cancel, const std::function<uint64_t(size_t)>& process) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  std::mutex mtx_progress;
+  Progress progress;
+  progress.total = jobs.size();
+  pool.parallel_for(jobs.size(), [&](size_t i) {
+    if (cancel.cancelled()) {
+      return;
+    }
+    uint64_t bytes = 0;
+    std::exception_ptr error;
+    try {
+      bytes = process(i);
+    }
+    catch (const Cancelled&) {
+      return;
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mtx_progress);
+    if (!error) {
+      ++progress.completed;
+      progress.bytes += bytes;
+    }
+    progress.elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    if (callbacks.on_item) {
+      callbacks.on_item(jobs[i], error);
+    }
+    if (callbacks.on_progress) {
+      callbacks.on_progress(progress);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    });
+  progress.elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  return progress;
+}
+
+} // namespace
+
+std::vector<ArchiveJob> list_zip_jobs(ThreadPool& pool, const fs::path& input_dir, const fs::path& output_dir,
+  const ZipOptions& options, ListSummary* summary) {
+  auto subdirs = list_subdirs(input_dir, options.depth, options.all, options.include_files);
+  ListSummary counts;
+  if (options.skip_empty) {
+    auto result = std::remove_if(subdirs.begin(), subdirs.end(), [](auto& d) {
+      return fs::is_directory(d) && fs::is_empty(d);
+      });
+    counts.skipped_empty = std::distance(result, subdirs.end());
+    subdirs.erase(result, subdirs.end());
+  }
+
+  std::vector<std::vector<ArchiveJob>> nested(subdirs.size());
+  pool.parallel_for(subdirs.size(), [&](size_t i) {
+    auto output = zip_output_path(input_dir, output_dir, subdirs[i]);
+    if (options.max_archive_size > 0 && fs::is_directory(subdirs[i])) {
+      nested[i] = split_directory(subdirs[i], output, options.max_archive_size);
+    }
+    else {
+      nested[i].push_back(ArchiveJob{ subdirs[i], output, {}, 0 });
+    }
+    });
+  if (options.skip_existing) {
+    // a set is complete only when every planned output exists.
+    auto result = std::remove_if(nested.begin(), nested.end(), [](const std::vector<ArchiveJob>& set) {
+      return std::all_of(set.cbegin(), set.cend(), [](const ArchiveJob& job) { return fs::exists(job.output); });
+      });
+    counts.skipped_existing = std::distance(result, nested.end());
+    nested.erase(result, nested.end());
+  }
+  if (summary) {
+    *summary = counts;
+  }
+  return flatten_nested(nested);
+}
+
+std::vector<ArchiveJob> list_unzip_jobs(const fs::path& input_dir, const fs::path& output_dir,
+  const UnzipOptions& options, ListSummary* summary) {
+  auto zipfiles = list_zipfiles(input_dir, options.depth);
+  ListSummary counts;
+  if (options.skip_existing) {
+    auto result = std::remove_if(zipfiles.begin(), zipfiles.end(), [&input_dir, &output_dir](auto& zf) {
+      auto output = unzip_output_path(input_dir, output_dir, zf);
+      return fs::exists(output);
+      });
+    counts.skipped_existing = std::distance(result, zipfiles.end());
+    zipfiles.erase(result, zipfiles.end());
+  }
+  if (summary) {
+    *summary = counts;
+  }
+  std::vector<ArchiveJob> jobs;
+  std::transform(zipfiles.cbegin(), zipfiles.cend(), std::back_inserter(jobs), [&input_dir, &output_dir](const fs::path& zf) {
+    return ArchiveJob{ zf, unzip_output_path(input_dir, output_dir, zf), {}, 0 };
+    });
+  std::unordered_map<fs::path::string_type, const ArchiveJob*> plain_archives;
+  for (const auto& job : jobs) {
+    if (!is_split_part(job.input)) {
+      plain_archives.emplace(job.output.native(), &job);
+    }
+  }
+  for (const auto& job : jobs) {
+    auto plain = plain_archives.find(job.output.native());
+    if (plain != plain_archives.end() && plain->second != &job) {
+      throw std::runtime_error("Both " + plain->second->input.string() + " and " + job.input.string()
+        + " would be extracted into " + job.output.string());
+    }
+  }
+  return jobs;
+}
+
+std::vector<ArchiveJob> list_rezip_jobs(const fs::path& input_dir, const fs::path& output_dir,
+  const RezipOptions& options, ListSummary* summary) {
+  auto zipfiles = list_zipfiles(input_dir, options.depth);
+  ListSummary counts;
+  if (options.skip_existing) {
+    auto result = std::remove_if(zipfiles.begin(), zipfiles.end(), [&input_dir, &output_dir](auto& zf) {
+      auto output = rezip_output_path(input_dir, output_dir, zf);
+      return fs::exists(output);
+      });
+    counts.skipped_existing = std::distance(result, zipfiles.end());
+    zipfiles.erase(result, zipfiles.end());
+  }
+  if (summary) {
+    *summary = counts;
+  }
+  std::vector<ArchiveJob> jobs;
+  std::transform(zipfiles.cbegin(), zipfiles.cend(), std::back_inserter(jobs), [&input_dir, &output_dir](const fs::path& zf) {
+    return ArchiveJob{ zf, rezip_output_path(input_dir, output_dir, zf), {}, 0 };
+    });
+  return jobs;
+}
+
+Progress zip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs, const ZipOptions& options,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  PathList output_parents;
+  output_parents.reserve(jobs.size());
+  std::transform(jobs.cbegin(), jobs.cend(), std::back_inserter(output_parents), [](const ArchiveJob& job) {
+    return job.output.parent_path();
+    });
+  DirCache dir_cache;
+  dir_cache.create_all(output_parents, pool);
+
+  // parts of a split set share "<name>.zip". When splitting is enabled, files of earlier runs which
+  // are not part of the new set are removed once the whole set has been written.
+  std::unordered_map<fs::path::string_type, size_t> set_ids;
+  std::vector<size_t> set_of(jobs.size());
+  PathList set_plain_zip;
+  std::vector<size_t> set_size;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto plain_zip = archive_base(jobs[i].output);
+    plain_zip += ".zip";
+    auto [it, inserted] = set_ids.emplace(plain_zip.native(), set_plain_zip.size());
+    if (inserted) {
+      set_plain_zip.push_back(plain_zip);
+      set_size.push_back(0);
+    }
+    set_of[i] = it->second;
+    ++set_size[it->second];
+  }
+  std::unique_ptr<std::atomic<size_t>[]> remaining(new std::atomic<size_t>[set_size.size()]);
+  for (size_t s = 0; s < set_size.size(); ++s) {
+    remaining[s] = set_size[s];
+  }
+
+  return run_batch(pool, jobs, callbacks, cancel, [&](size_t i) {
+    auto bytes = zip_directory(jobs[i], options, cancel);
+    auto s = set_of[i];
+    if (options.max_archive_size > 0 && --remaining[s] == 0) {
+      bool split = jobs[i].output != set_plain_zip[s];
+      remove_stale_outputs(set_plain_zip[s], split ? set_size[s] : 0);
+    }
+    return bytes;
+    });
+}
+
+Progress zip_batch(const std::vector<ArchiveJob>& jobs, const ZipOptions& options,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  ThreadPool pool(options.jobs);
+  return zip_batch(pool, jobs, options, callbacks, cancel);
+}
+
+Progress unzip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  std::vector<PathList> nested(jobs.size());
+  pool.parallel_for(jobs.size(), [&jobs, &nested](size_t i) {
+    nested[i] = list_entry_dirs(jobs[i].input, jobs[i].output);
+    });
+  DirCache dir_cache;
+  dir_cache.create_all(flatten_nested(nested), pool);
+  return run_batch(pool, jobs, callbacks, cancel, [&jobs, &cancel](size_t i) {
+    return unzip(jobs[i].input, jobs[i].output, cancel);
+    });
+}
+
+Progress unzip_batch(const std::vector<ArchiveJob>& jobs, const UnzipOptions& options,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  ThreadPool pool(options.jobs);
+  return unzip_batch(pool, jobs, callbacks, cancel);
+}
+
+Progress rezip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs, const RezipOptions& options,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  PathList output_parents;
+  output_parents.reserve(jobs.size());
+  std::transform(jobs.cbegin(), jobs.cend(), std::back_inserter(output_parents), [](const ArchiveJob& job) {
+    return job.output.parent_path();
+    });
+  DirCache dir_cache;
+  dir_cache.create_all(output_parents, pool);
+  return run_batch(pool, jobs, callbacks, cancel, [&jobs, &options, &cancel](size_t i) {
+    return rezip(jobs[i].input, jobs[i].output, options, cancel);
+    });
+}
+
+Progress rezip_batch(const std::vector<ArchiveJob>& jobs, const RezipOptions& options,
+  const BatchCallbacks& callbacks, const CancellationToken& cancel) {
+  ThreadPool pool(options.jobs);
+  return rezip_batch(pool, jobs, options, callbacks, cancel);
+}
@@ -6,6 +6,16 @@
 #include <numeric>
 #include <algorithm>
 #include <filesystem>
+#include <shared_mutex>
+#include <unordered_set>
+#include <optional>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define CONCATENATE(e1, e2) e1 ## e2
 
@@ -41,6 +51,160 @@ std::vector<T> flatten_nested(const std::vector<std::vector<T>>& nested) {
 using PathList = std::vector<std::filesystem::path>;
 PathList list_subdirs(const std::filesystem::path& indir, int depth, bool all, bool include_files);
 
+std::string path2utf8(const std::filesystem::path& path);
+
+// Split archives are named "<name>.partNNN.zip" (NNN starts from 001).
+std::filesystem::path split_part_path(const std::filesystem::path& zip_path, size_t part);
+// "<name>.partNNN" -> "<name>". Other paths are returned as they are.
+std::filesystem::path remove_part_extension(const std::filesystem::path& path);
+// True for "<name>.partNNN.zip" when "<name>.part001.zip" exists, i.e. a member of a split archive.
+bool is_split_part(const std::filesystem::path& zip_path);
+
+// Fixed set of worker threads which can be reused for many batches.
+class ThreadPool {
+private:
+  std::vector<std::thread> workers;
+  std::mutex mtx_batch; // one batch at a time
+  std::mutex mtx;
+  std::condition_variable cv_start;
+  std::condition_variable cv_done;
+  const std::function<void(size_t)>* task = nullptr;
+  size_t task_size = 0;
+  std::atomic<size_t> next{ 0 };
+  size_t generation = 0;
+  size_t running = 0;
+  bool stop = false;
+  std::exception_ptr ep;
+  void work();
+public:
+  // jobs <= 0: use all physical cores.
+  explicit ThreadPool(int jobs = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  int size() const { return static_cast<int>(workers.size()); }
+  // Call fn(0), ..., fn(n - 1) on the workers and wait for them.
+  // The first exception stops the remaining calls and is rethrown. Must not be called from inside fn.
+  void parallel_for(size_t n, const std::function<void(size_t)>& fn);
+};
+
+// Thread-safe record of directories known to exist.
+// Each directory is created (and its ancestors checked) at most once per cache.
+class DirCache {
+private:
+  using Key = std::filesystem::path::string_type;
+  std::shared_mutex mtx;
+  std::unordered_set<Key> created;
+  bool contains(const Key& key);
+public:
+  void create(const std::filesystem::path& dir);
+  void create_all(const PathList& dirs, ThreadPool& pool);
+};
+
+// Cooperative cancellation. Copies share the same state.
+class CancellationToken {
+private:
+  std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+public:
+  void cancel() const { *flag = true; }
+  bool cancelled() const { return *flag; }
+};
+
+enum class CompressMethod {
+  Store,
+  Deflate,
+};
+
+struct ZipOptions {
+  int depth = 0;                   // depth of the subdirectories
+  bool all = false;                // do not ignore hidden entries
+  bool include_files = false;      // compress files too, not just directories
+  bool skip_empty = false;         // skip empty directories
+  bool skip_existing = false;      // skip when the output exists
+  uint64_t max_archive_size = 0;   // split into <name>.partNNN.zip files of about this input size. 0: no split
+  int16_t level = 1;
+  CompressMethod method = CompressMethod::Deflate;
+  int jobs = 0;                    // used when no ThreadPool is given. <= 0: all physical cores
+};
+
+struct UnzipOptions {
+  int depth = 0;                   // depth of the subdirectories
+  bool skip_existing = false;      // skip when the output directory exists
+  int jobs = 0;                    // used when no ThreadPool is given. <= 0: all physical cores
+};
+
+struct RezipOptions {
+  int depth = 0;                   // depth of the subdirectories
+  bool skip_existing = false;      // skip when the output exists
+  bool force = false;              // recompress entries even when their method and level look unchanged
+  int16_t level = 1;
+  CompressMethod method = CompressMethod::Deflate;
+  int jobs = 0;                    // used when no ThreadPool is given. <= 0: all physical cores
+};
+
+// One archive to create or extract.
+struct ArchiveJob {
+  std::filesystem::path input;
+  std::filesystem::path output;
+  std::optional<PathList> entries; // zip only. Paths under input to compress, nullopt: everything
+  uint64_t bytes = 0;              // input bytes of entries, if known
+};
+
+struct ListSummary {
+  size_t skipped_existing = 0;
+  size_t skipped_empty = 0;
+};
+
+struct Progress {
+  size_t completed = 0;            // finished jobs
+  size_t total = 0;
+  uint64_t bytes = 0;              // uncompressed bytes of finished jobs
+  double elapsed = 0;              // seconds
+  double throughput() const { return elapsed > 0 ? bytes / elapsed : 0; } // bytes per second
+};
+
+// Called from worker threads, one call at a time.
+struct BatchCallbacks {
+  // After each job. `error` is null on success.
+  std::function<void(const ArchiveJob& job, std::exception_ptr error)> on_item;
+  std::function<void(const Progress& progress)> on_progress;
+};
+
+std::filesystem::path zip_output_path(const std::filesystem::path& input_dir, const std::filesystem::path& output_dir, const std::filesystem::path& input);
+std::filesystem::path unzip_output_path(const std::filesystem::path& input_dir, const std::filesystem::path& output_dir, const std::filesystem::path& input);
+std::filesystem::path rezip_output_path(const std::filesystem::path& input_dir, const std::filesystem::path& output_dir, const std::filesystem::path& input);
+PathList list_zipfiles(const std::filesystem::path& indir, int depth);
+
+std::vector<ArchiveJob> list_zip_jobs(ThreadPool& pool, const std::filesystem::path& input_dir, const std::filesystem::path& output_dir,
+  const ZipOptions& options, ListSummary* summary = nullptr);
+// Throws if a plain archive and a split archive would be extracted into the same directory.
+std::vector<ArchiveJob> list_unzip_jobs(const std::filesystem::path& input_dir, const std::filesystem::path& output_dir,
+  const UnzipOptions& options, ListSummary* summary = nullptr);
+std::vector<ArchiveJob> list_rezip_jobs(const std::filesystem::path& input_dir, const std::filesystem::path& output_dir,
+  const RezipOptions& options, ListSummary* summary = nullptr);
+
+// Run the jobs in parallel. The first error stops the batch and is rethrown after the running jobs finish.
+// Zip outputs are written to "<output>.tmp" and renamed when complete, so a failed or cancelled zip job
+// leaves no output. With max_archive_size, once a set is written, "<name>.zip"/"<name>.partNNN.zip" files of
+// earlier runs which do not belong to it are removed.
+// On cancellation, no new job is started and running unzip jobs stop at the next entry.
+Progress zip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs, const ZipOptions& options,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+Progress zip_batch(const std::vector<ArchiveJob>& jobs, const ZipOptions& options,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+Progress unzip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+Progress unzip_batch(const std::vector<ArchiveJob>& jobs, const UnzipOptions& options,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+// Entries are copied from zip to zip without touching the disk in between.
+// Entries whose method and level stay the same, and entries compressed by methods other than
+// store/deflate, are copied without decompression. Corrupted entries (CRC mismatch) are errors.
+// The output is written to "<output>.tmp" and renamed, so output may be the same as input.
+Progress rezip_batch(ThreadPool& pool, const std::vector<ArchiveJob>& jobs, const RezipOptions& options,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+Progress rezip_batch(const std::vector<ArchiveJob>& jobs, const RezipOptions& options,
+  const BatchCallbacks& callbacks = {}, const CancellationToken& cancel = {});
+
 #ifdef _WIN32
 std::string wstr2utf8(std::wstring const& src);
 class local_setmode {
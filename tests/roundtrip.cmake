@@ -0,0 +1,168 @@
+# Archive INPUT, extract it again and compare the result with INPUT.
+# cmake -DMODE=split|rezip -DZIPDIRS=... -DUNZIPDIRS=... [-DREZIPDIRS=...] -DINPUT=... -DWORK=... -P roundtrip.cmake
+
+function(run)
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Failed (${result}): ${ARGN}")
+  endif()
+endfunction()
+
+function(compare_dirs expected actual)
+  file(GLOB_RECURSE expected_files RELATIVE ${expected} ${expected}/*)
+  file(GLOB_RECURSE actual_files RELATIVE ${actual} ${actual}/*)
+  list(SORT expected_files)
+  list(SORT actual_files)
+  if(NOT expected_files STREQUAL actual_files)
+    message(FATAL_ERROR "File lists differ:\n${expected_files}\n${actual_files}")
+  endif()
+  foreach(f ${expected_files})
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${expected}/${f} ${actual}/${f} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "Contents differ: ${f}")
+    endif()
+  endforeach()
+endfunction()
+
+# "<method>:<flags>:<compressed size>" of every non-empty entry in the central directory of `zip`.
+# Values are little endian hex strings, e.g. method "0800" is deflate and "0000" is store.
+function(zip_entries zip out_var)
+  file(READ ${zip} hex HEX)
+  string(LENGTH "${hex}" length)
+  set(entries)
+  set(pos 0)
+  while(pos LESS length)
+    string(SUBSTRING "${hex}" ${pos} -1 rest)
+    string(FIND "${rest}" "504b0102" found)
+    if(found EQUAL -1)
+      break()
+    endif()
+    math(EXPR start "${pos} + ${found}")
+    math(EXPR pos "${start} + 8")
+    math(EXPR odd "${start} % 2")
+    if(odd)
+      continue()
+    endif()
+    math(EXPR flags_at "${start} + 16")
+    math(EXPR method_at "${start} + 20")
+    math(EXPR compressed_at "${start} + 40")
+    math(EXPR uncompressed_at "${start} + 48")
+    string(SUBSTRING "${hex}" ${flags_at} 4 flags)
+    string(SUBSTRING "${hex}" ${method_at} 4 method)
+    string(SUBSTRING "${hex}" ${compressed_at} 8 compressed)
+    string(SUBSTRING "${hex}" ${uncompressed_at} 8 uncompressed)
+    if(NOT uncompressed STREQUAL "00000000")
+      list(APPEND entries "${method}:${flags}:${compressed}")
+    endif()
+  endwhile()
+  set(${out_var} ${entries} PARENT_SCOPE)
+endfunction()
+
+# Check every non-empty entry of the zip files in `dir` against `method` ("0800"/"0000")
+# and, for deflate, the level bits of the flags (6: level 1, 2: level 8-9).
+function(check_entries dir method level_bits)
+  file(GLOB zips ${dir}/*.zip)
+  if(NOT zips)
+    message(FATAL_ERROR "No zip files in ${dir}")
+  endif()
+  foreach(zip ${zips})
+    zip_entries(${zip} entries)
+    if(NOT entries)
+      message(FATAL_ERROR "No entries found in ${zip}")
+    endif()
+    foreach(entry ${entries})
+      string(REPLACE ":" ";" fields ${entry})
+      list(GET fields 0 m)
+      list(GET fields 1 f)
+      if(NOT m STREQUAL method)
+        message(FATAL_ERROR "${zip}: method ${m} instead of ${method}")
+      endif()
+      if(DEFINED level_bits AND NOT level_bits STREQUAL "")
+        string(SUBSTRING ${f} 0 2 low)
+        math(EXPR bits "0x${low} & 6")
+        if(NOT bits EQUAL level_bits)
+          message(FATAL_ERROR "${zip}: level flags ${bits} instead of ${level_bits}")
+        endif()
+      endif()
+    endforeach()
+  endforeach()
+endfunction()
+
+file(REMOVE_RECURSE ${WORK})
+
+if(MODE STREQUAL "split")
+  # "folder" holds about 150 bytes of files, so a 30 byte limit splits it into several parts.
+  run(${ZIPDIRS} ${INPUT} ${WORK}/zip --max-archive-size 30)
+  file(GLOB parts ${WORK}/zip/folder.part*.zip)
+  list(LENGTH parts n_parts)
+  if(n_parts LESS 2)
+    message(FATAL_ERROR "folder was not split: ${parts}")
+  endif()
+  run(${UNZIPDIRS} ${WORK}/zip ${WORK}/out)
+  compare_dirs(${INPUT} ${WORK}/out)
+
+  # a single file larger than the limit must not produce extra parts.
+  file(WRITE ${WORK}/big/big/large.txt "0123456789012345678901234567890123456789")
+  run(${ZIPDIRS} ${WORK}/big ${WORK}/bigzip --max-archive-size 10)
+  if(NOT EXISTS ${WORK}/bigzip/big.zip OR EXISTS ${WORK}/bigzip/big.part002.zip)
+    message(FATAL_ERROR "Unexpected parts for a single large file")
+  endif()
+
+  # empty files do not add to a part's size, so they must not get parts of their own.
+  set(fifty "01234567890123456789012345678901234567890123456789")
+  file(WRITE ${WORK}/zero/one/large.txt "${fifty}${fifty}")
+  file(WRITE ${WORK}/zero/one/empty1.txt "")
+  file(WRITE ${WORK}/zero/one/empty2.txt "")
+  file(WRITE ${WORK}/zero/two/a.txt "${fifty}")
+  file(WRITE ${WORK}/zero/two/b.txt "${fifty}")
+  file(WRITE ${WORK}/zero/two/empty1.txt "")
+  file(WRITE ${WORK}/zero/two/empty2.txt "")
+  run(${ZIPDIRS} ${WORK}/zero ${WORK}/zerozip --max-archive-size 40)
+  if(NOT EXISTS ${WORK}/zerozip/one.zip OR EXISTS ${WORK}/zerozip/one.part001.zip)
+    message(FATAL_ERROR "Unexpected parts for one non-empty file")
+  endif()
+  if(NOT EXISTS ${WORK}/zerozip/two.part002.zip OR EXISTS ${WORK}/zerozip/two.part003.zip)
+    message(FATAL_ERROR "Unexpected parts for two non-empty files")
+  endif()
+  run(${UNZIPDIRS} ${WORK}/zerozip ${WORK}/zeroout)
+  compare_dirs(${WORK}/zero ${WORK}/zeroout)
+
+  # a new set replaces the files of the previous one.
+  run(${ZIPDIRS} ${WORK}/zero ${WORK}/zerozip --max-archive-size 1000)
+  if(NOT EXISTS ${WORK}/zerozip/two.zip OR EXISTS ${WORK}/zerozip/two.part001.zip OR EXISTS ${WORK}/zerozip/two.part002.zip)
+    message(FATAL_ERROR "Stale parts are left")
+  endif()
+elseif(MODE STREQUAL "rezip")
+  run(${ZIPDIRS} ${INPUT} ${WORK}/zip)
+  check_entries(${WORK}/zip "0800" 6)
+
+  # unchanged method and level: entries are copied as they are.
+  run(${REZIPDIRS} ${WORK}/zip ${WORK}/same --level 1)
+  file(GLOB zips RELATIVE ${WORK}/zip ${WORK}/zip/*.zip)
+  foreach(zip ${zips})
+    zip_entries(${WORK}/zip/${zip} expected)
+    zip_entries(${WORK}/same/${zip} actual)
+    file(SIZE ${WORK}/zip/${zip} expected_size)
+    file(SIZE ${WORK}/same/${zip} actual_size)
+    if(NOT expected STREQUAL actual OR NOT expected_size EQUAL actual_size)
+      message(FATAL_ERROR "${zip} was not copied as it is:\n${expected} (${expected_size} bytes)\n${actual} (${actual_size} bytes)")
+    endif()
+  endforeach()
+
+  run(${REZIPDIRS} ${WORK}/zip ${WORK}/rezip --level 9)
+  check_entries(${WORK}/rezip "0800" 2)
+  run(${UNZIPDIRS} ${WORK}/rezip ${WORK}/out)
+  compare_dirs(${INPUT} ${WORK}/out)
+
+  # in place, with another method.
+  run(${REZIPDIRS} ${WORK}/zip --method store)
+  check_entries(${WORK}/zip "0000" "")
+  file(GLOB leftovers ${WORK}/zip/*.tmp)
+  if(leftovers)
+    message(FATAL_ERROR "Temporary files are left: ${leftovers}")
+  endif()
+  run(${UNZIPDIRS} ${WORK}/zip ${WORK}/out_store)
+  compare_dirs(${INPUT} ${WORK}/out_store)
+else()
+  message(FATAL_ERROR "Unknown MODE: ${MODE}")
+endif()
@@ -0,0 +1,207 @@
+#include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <stdexcept>
+#include "szkarc.h"
+
+namespace fs = std::filesystem;
+using std::cerr;
+using std::endl;
+
+static int failures = 0;
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << endl; \
+    ++failures; \
+  } \
+} while (0)
+
+uint64_t total_file_size(const fs::path& dir) {
+  uint64_t total = 0;
+  for (const auto& ent : fs::recursive_directory_iterator(dir)) {
+    if (ent.is_regular_file()) {
+      total += ent.file_size();
+    }
+  }
+  return total;
+}
+
+size_t count_files(const fs::path& dir, const std::string& extension) {
+  if (!fs::exists(dir)) {
+    return 0;
+  }
+  return std::count_if(fs::directory_iterator(dir), fs::directory_iterator(), [&extension](const fs::directory_entry& ent) {
+    return ent.path().extension() == extension;
+    });
+}
+
+std::string read_file(const fs::path& path) {
+  std::ifstream ifs(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+bool same_tree(const fs::path& expected, const fs::path& actual) {
+  PathList expected_entries, actual_entries;
+  for (const auto& ent : fs::recursive_directory_iterator(expected)) {
+    expected_entries.push_back(ent.path().lexically_relative(expected));
+  }
+  for (const auto& ent : fs::recursive_directory_iterator(actual)) {
+    actual_entries.push_back(ent.path().lexically_relative(actual));
+  }
+  std::sort(expected_entries.begin(), expected_entries.end());
+  std::sort(actual_entries.begin(), actual_entries.end());
+  if (expected_entries != actual_entries) {
+    return false;
+  }
+  return std::all_of(expected_entries.cbegin(), expected_entries.cend(), [&expected, &actual](const fs::path& p) {
+    return fs::is_directory(expected / p) || read_file(expected / p) == read_file(actual / p);
+    });
+}
+
+void test_thread_pool() {
+  ThreadPool pool(4);
+  CHECK(pool.size() == 4);
+  for (int round = 0; round < 3; ++round) {
+    std::atomic<size_t> sum{ 0 };
+    pool.parallel_for(1000, [&sum](size_t i) { sum += i; });
+    CHECK(sum == 499500);
+  }
+  bool thrown = false;
+  try {
+    pool.parallel_for(100, [](size_t i) {
+      if (i == 50) {
+        throw std::runtime_error("error");
+      }
+      });
+  }
+  catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  // still usable after an error.
+  std::atomic<size_t> count{ 0 };
+  pool.parallel_for(10, [&count](size_t) { ++count; });
+  CHECK(count == 10);
+}
+
+// zip and unzip batches on one pool, checking the callbacks.
+void test_batches(const fs::path& input, const fs::path& work) {
+  ThreadPool pool(3);
+  ZipOptions options;
+  auto zip_jobs = list_zip_jobs(pool, input, work / "zip", options);
+  CHECK(zip_jobs.size() == 3);
+
+  size_t items = 0;
+  size_t errors = 0;
+  size_t progress_calls = 0;
+  Progress last;
+  BatchCallbacks callbacks;
+  callbacks.on_item = [&items, &errors](const ArchiveJob&, std::exception_ptr error) {
+    ++items;
+    errors += error ? 1 : 0;
+  };
+  callbacks.on_progress = [&progress_calls, &last](const Progress& progress) {
+    CHECK(progress.completed == last.completed + 1);
+    CHECK(progress.bytes >= last.bytes);
+    ++progress_calls;
+    last = progress;
+  };
+  auto progress = zip_batch(pool, zip_jobs, options, callbacks);
+  CHECK(items == zip_jobs.size());
+  CHECK(errors == 0);
+  CHECK(progress_calls == zip_jobs.size());
+  CHECK(progress.completed == zip_jobs.size());
+  CHECK(progress.total == zip_jobs.size());
+  CHECK(progress.bytes == total_file_size(input));
+  CHECK(last.bytes == progress.bytes);
+  CHECK(count_files(work / "zip", ".zip") == zip_jobs.size());
+  CHECK(count_files(work / "zip", ".tmp") == 0);
+
+  items = 0;
+  progress_calls = 0;
+  last = Progress();
+  auto unzip_jobs = list_unzip_jobs(work / "zip", work / "out", UnzipOptions{});
+  progress = unzip_batch(pool, unzip_jobs, callbacks);
+  CHECK(items == unzip_jobs.size());
+  CHECK(progress.completed == unzip_jobs.size());
+  CHECK(progress.bytes == total_file_size(input));
+  CHECK(same_tree(input, work / "out"));
+
+  // many small batches on the same pool.
+  for (int round = 0; round < 5; ++round) {
+    auto out = work / ("rounds" + std::to_string(round));
+    progress = zip_batch(pool, list_zip_jobs(pool, input, out, options), options);
+    CHECK(progress.completed == zip_jobs.size());
+  }
+}
+
+void test_cancel(const fs::path& input, const fs::path& work) {
+  ZipOptions options;
+
+  // cancelled beforehand: nothing is written.
+  {
+    ThreadPool pool(2);
+    CancellationToken cancel;
+    cancel.cancel();
+    auto out = work / "cancel_before";
+    auto progress = zip_batch(pool, list_zip_jobs(pool, input, out, options), options, {}, cancel);
+    CHECK(progress.completed == 0);
+    CHECK(count_files(out, ".zip") == 0);
+    CHECK(count_files(out, ".tmp") == 0);
+  }
+  // cancelled by the first finished job: no new job is started.
+  {
+    ThreadPool pool(1);
+    CancellationToken cancel;
+    BatchCallbacks callbacks;
+    callbacks.on_item = [&cancel](const ArchiveJob&, std::exception_ptr) { cancel.cancel(); };
+    auto out = work / "cancel_first";
+    auto progress = zip_batch(pool, list_zip_jobs(pool, input, out, options), options, callbacks, cancel);
+    CHECK(progress.completed == 1);
+    CHECK(count_files(out, ".zip") == 1);
+    CHECK(count_files(out, ".tmp") == 0);
+  }
+  // cancelled while other jobs may be running: aborted jobs leave neither output nor temporary file.
+  {
+    ThreadPool pool(2);
+    CancellationToken cancel;
+    BatchCallbacks callbacks;
+    callbacks.on_item = [&cancel](const ArchiveJob&, std::exception_ptr) { cancel.cancel(); };
+    auto out = work / "cancel_running";
+    ZipOptions split = options;
+    split.max_archive_size = 10;
+    auto progress = zip_batch(pool, list_zip_jobs(pool, input, out, split), split, callbacks, cancel);
+    CHECK(progress.completed < progress.total);
+    CHECK(count_files(out, ".zip") == progress.completed);
+    CHECK(count_files(out, ".tmp") == 0);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 3) {
+    cerr << "Usage: test_szkarc <input> <work>" << endl;
+    return 1;
+  }
+  try {
+    fs::path input(argv[1]);
+    fs::path work(argv[2]);
+    fs::remove_all(work);
+    test_thread_pool();
+    test_batches(input, work);
+    test_cancel(input, work);
+  }
+  catch (std::exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  if (failures > 0) {
+    cerr << failures << " check(s) failed." << endl;
+    return 1;
+  }
+  return 0;
+}
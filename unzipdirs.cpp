@@ -1,15 +1,6 @@
 #include <filesystem>
 #include <iostream>
-#include <vector>
-#include <numeric>
-#include <thread>
 #include <exception>
-#include <mz.h>
-#include <mz_os.h>
-#include <mz_strm.h>
-#include <mz_strm_os.h>
-#include <mz_zip.h>
-#include <mz_zip_rw.h>
 #include <tclap/CmdLine.h>
 #include <indicators/progress_bar.hpp>
 #include <config.h>
@@ -21,73 +12,6 @@ using std::cerr;
 using std::endl;
 using std::flush;
 
-void unzip(const fs::path& input, const fs::path& output)
-{
-  void* zip_reader;
-  void* file_stream;
-  mz_zip_reader_create(&zip_reader);
-  mz_stream_os_create(&file_stream);
-
-  int32_t err = stream_os_open(file_stream, input, MZ_OPEN_MODE_READ);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to open a zip file:" + input.string());
-  }
-  err = mz_zip_reader_open(zip_reader, file_stream);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to open a zip file:" + input.string());
-  }
-#ifdef _WIN32
-  auto utf8 = wstr2utf8(output.wstring());
-  mz_zip_reader_save_all(zip_reader, utf8.c_str());
-#else
-  mz_zip_reader_save_all(zip_reader, output.c_str());
-#endif
-
-  err = mz_zip_reader_close(zip_reader);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to close a zip file:" + input.string());
-  }
-  err = mz_stream_os_close(file_stream);
-  if (err != MZ_OK) {
-    throw std::runtime_error("Failed to close a zip file:" + input.string());
-  }
-  mz_stream_os_delete(&file_stream);
-  mz_zip_reader_delete(&zip_reader);
-}
-
-using PathList = std::vector<fs::path>;
-PathList list_zipfiles(const fs::path& indir, int depth) {
-  PathList list;
-  if (depth > 0) {
-    for (const auto& ent : fs::directory_iterator(indir)) {
-      if (ent.is_directory()) {
-        list.emplace_back(ent.path());
-      }
-    }
-    std::sort(list.begin(), list.end());
-    std::vector<PathList> nested;
-    std::transform(list.cbegin(), list.cend(), std::back_inserter(nested), [depth](const fs::path& p) {
-      return list_zipfiles(p, depth - 1);
-      });
-    auto flat = flatten_nested(nested);
-    return flat;
-  }
-  else {
-    for (const auto& ent : fs::directory_iterator(indir)) {
-      if (ent.path().extension()==".zip") {
-        list.emplace_back(ent.path());
-      }
-    }
-    std::sort(list.begin(), list.end());
-    return list;
-  }
-}
-
-fs::path input2output(const fs::path &input_dir, const fs::path &output_dir, const fs::path &input) {
-  auto relative = input.lexically_relative(input_dir);
-  return (output_dir / relative.replace_extension("")).WSTRING();
-}
-
 int main(int argc, char* argv[])
 {
   try {
@@ -104,27 +28,23 @@ int main(int argc, char* argv[])
 
     auto input_dir = fs::path(a_input.getValue());
     auto output_dir = fs::path(a_output.isSet() ? a_output.getValue() : a_input.getValue());
-    auto depth = a_depth.getValue();
-    auto jobs = a_jobs.getValue();
-    auto zipfiles = list_zipfiles(input_dir, depth);
-    if (a_skip_exists.isSet()) {
-      auto result = std::remove_if(zipfiles.begin(), zipfiles.end(), [&input_dir, &output_dir](auto& zf) {
-        auto output = input2output(input_dir, output_dir, zf);
-        return fs::exists(output);
-        });
-      auto orig_size = zipfiles.size();
-      zipfiles.erase(result, zipfiles.end());
-      cout << "Skip " << orig_size - zipfiles.size() << " existing entries." << endl;
+    UnzipOptions options;
+    options.depth = a_depth.getValue();
+    options.skip_existing = a_skip_exists.isSet();
+    options.jobs = a_jobs.getValue();
+    ListSummary summary;
+    auto unzip_jobs = list_unzip_jobs(input_dir, output_dir, options, &summary);
+    if (options.skip_existing) {
+      cout << "Skip " << summary.skipped_existing << " existing entries." << endl;
     }
-    if (zipfiles.empty()) {
+    if (unzip_jobs.empty()) {
       cout << "There is nothing to decompress." << endl;
       return 0;
     }
     if (a_dryrun.isSet()) {
       auto mode = local_setmode();
-      for (const auto& zf : zipfiles) {
-        auto output = input2output(input_dir, output_dir, zf);
-        WCOUT << zf.WSTRING() << " -> " << output.WSTRING() << '\n';
+      for (const auto& job : unzip_jobs) {
+        WCOUT << job.input.WSTRING() << " -> " << job.output.WSTRING() << '\n';
       }
       cout << flush;
       return 0;
@@ -132,7 +52,7 @@ int main(int argc, char* argv[])
     using namespace indicators;
     ProgressBar bar{
        option::BarWidth{30},
-       option::MaxProgress(zipfiles.size()),
+       option::MaxProgress(unzip_jobs.size()),
        option::Start{"["},
        option::Fill{"="},
        option::Lead{">"},
@@ -142,42 +62,17 @@ int main(int argc, char* argv[])
        option::ShowElapsedTime{true},
        option::ShowRemainingTime{true},
     };
-    if (jobs <= 0) {
-      jobs = get_physical_core_counts();
-      cout << "Using " << jobs << " CPU cores." << endl;
-    }
-    std::exception_ptr ep;
-    std::mutex mtx_mkdir;
-    std::vector<std::thread> threads;
-    threads.reserve(jobs);
-    for (int job_id = 0; job_id < jobs; ++job_id) {
-      threads.emplace_back([job_id, jobs, &zipfiles, &input_dir, &output_dir, &bar, &mtx_mkdir, &ep]() {
-        for (int i = job_id; i < zipfiles.size(); i += jobs) {
-          const auto& zipfile = zipfiles[i];
-          auto output = input2output(input_dir, output_dir, zipfile);
-          {
-            std::lock_guard<std::mutex> lock(mtx_mkdir);
-            if (!fs::exists(output.parent_path())) {
-              fs::create_directories(output.parent_path());
-            }
-          }
-          try {
-            unzip(zipfile, output);
-          }
-          catch (...) {
-            ep = std::current_exception();
-            break;
-          }
-          bar.tick();
-        }
-        });
-    }
-    for (auto& t : threads) {
-      t.join();
-    }
-    if (ep) {
-      std::rethrow_exception(ep);
+    ThreadPool pool(options.jobs);
+    if (options.jobs <= 0) {
+      cout << "Using " << pool.size() << " CPU cores." << endl;
     }
+    BatchCallbacks callbacks;
+    callbacks.on_item = [&bar](const ArchiveJob&, std::exception_ptr error) {
+      if (!error) {
+        bar.tick();
+      }
+    };
+    unzip_batch(pool, unzip_jobs, callbacks);
   }
   catch (TCLAP::ArgException& e)
   {